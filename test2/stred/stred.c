@@ -1,18 +1,35 @@
 #include <linux/cdev.h>
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 #include <linux/semaphore.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "stred_ioctl.h"
 
 #define MAX_STR_SIZE    (101u)
 #define b_TRUE          (1u)
 #define b_FALSE         (0u)
 #define OK              (0u)
 #define ERROR           (-1)
-#define NUM_OF_COMMANDS (7u)
+#define BLOCKED         (1)									///< Returned by a command which has to wait for the string to change.
+#define NUM_OF_COMMANDS (10u)
+#define MAX_CMD_NAME    (8u)								///< Length of the longest command name ("truncate").
+#define MAX_CMD_SIZE    (MAX_CMD_NAME + 1u + MAX_STR_SIZE)	///< name + '=' + payload + trailing '\n'.
+#define MAX_BATCH_STEPS (16u)								///< Maximum number of newline-separated commands in a single write.
+#define MAX_BATCH_SIZE  (MAX_BATCH_STEPS * MAX_CMD_SIZE)
+#define HIST_BUCKETS    (32u)								///< Bucket b counts durations in [2^(b-1), 2^b) ns, the last one everything slower.
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -25,50 +42,360 @@ typedef enum
 	REMOVE,
 	CLEAR,
 	SHRINK,
-	HELP
+	HELP,
+	INSERT,
+	FIND,
+	COUNT
 } Command_t;
 
+// Tracepoints print commands by their Command_t name, so they are created once the enum is known
+#define CREATE_TRACE_POINTS
+#include "stred_trace.h"
+
+/// Contents of the String editor. Once published a buffer is never modified, writers publish a new version instead.
+typedef struct
+{
+	struct rcu_head rcu;			///< Frees the buffer once no reader can see it anymore.
+	unsigned long   version;		///< Incremented on every published buffer, returned by STRED_IOC_VERSION.
+	size_t          char_cnt;		///< Number of characters currently inside the string.
+	char            string[MAX_STR_SIZE];
+} StredBuf_t;
+
+/// One parsed command of a batch. A single command is a batch of one.
+typedef struct
+{
+	Command_t   command_id;
+	const char *payload;			///< Everything after '=', points into the written data and is not NUL-terminated.
+	size_t      len;				///< Payload length.
+	size_t      count;				///< Numeric argument (truncate count, insert offset), parsed once together with the command.
+} Step_t;
+
+/// Commands edit the staged copy of the string they are given, locking and wakeups are done once per batch.
+typedef ssize_t (*CommandHandler_t)(StredBuf_t *buf, const Step_t *step);
+
+/// One entry of the command table.
+typedef struct
+{
+	const char       *name;			///< Command name, without the '='.
+	size_t            name_len;		///< strlen(name), precomputed so matching is a single memcmp.
+	int               has_payload;	///< b_TRUE if the command has the "name=payload" format.
+	int               read_only;	///< b_TRUE if the command never changes the string.
+	CommandHandler_t  handler;
+} CommandDesc_t;
+
+/// Histograms kept for every command.
+typedef enum
+{
+	LOCK_WAIT = 0,		///< Time spent waiting for sem.
+	LOCK_HOLD,			///< Time sem was held by the batch the command is part of.
+	QUEUE_WAIT,			///< Time spent in a waiter queue or held back behind a granted waiter.
+	EXECUTION,			///< Time spent applying the command itself, once per attempt.
+	NUM_OF_HISTS
+} Hist_t;
+
+/// Statistics of one command. Atomic, since read-only batches update them without holding sem.
+/// A batch which has to wait is run again once the string changes, so histograms count attempts rather than calls.
+typedef struct
+{
+	atomic64_t calls;
+	atomic64_t attempts;						///< Times the command was applied to a staged copy, including retries.
+	atomic64_t errors;							///< Calls whose batch was not applied.
+	atomic64_t hist[NUM_OF_HISTS][HIST_BUCKETS];
+} CommandStats_t;
+
+/// A writer waiting for the string to reach a certain length, queued in arrival order.
+typedef struct
+{
+	struct list_head  node;
+	wait_queue_head_t wait;			///< Only this writer sleeps here, so a wakeup is never wasted on someone else.
+	long              limit;		///< Appends need char_cnt <= limit, truncates need char_cnt >= limit.
+	int               granted;		///< Set once it is the writer's turn and its request fits.
+} StredWaiter_t;
+
+/// One independent String editor. Every minor has its own, so unrelated clients never share a lock.
+typedef struct
+{
+	struct cdev        cdev;
+	struct device     *device;
+	struct semaphore   sem;			///< Serialises writers of this String editor only.
+	StredBuf_t __rcu  *buf;			///< Published contents, replaced under sem and read under rcu_read_lock.
+	struct list_head   append_waiters;	///< Appends and inserts waiting for room, oldest first.
+	struct list_head   trunc_waiters;	///< Truncates waiting for characters, oldest first.
+	int                append_granted;	///< A waiter of append_waiters fits and is about to run.
+	int                trunc_granted;	///< A waiter of trunc_waiters fits and is about to run.
+	wait_queue_head_t  yield_queue;		///< New writers held back so they don't take what was granted to a waiter.
+	unsigned int       minor;
+	CommandStats_t     stats[NUM_OF_COMMANDS];
+} StredDev_t;
+
 dev_t stred_dev_id;
 static struct class *stred_class;
-static struct device *stred_device;
-static struct cdev *stred_cdev;
+static StredDev_t   *stred_devs;
+static struct dentry *stred_debugfs;		///< debugfs directory with one statistics file per String editor.
+
+static unsigned int num_of_devices = 4u;
+module_param(num_of_devices, uint, 0444);
+MODULE_PARM_DESC(num_of_devices, "Number of independent String editors, one per minor.");
 
 int	OpenStred(struct inode *pinode, struct file *pfile);
 int	CloseStred(struct inode *pinode, struct file *pfile);
 ssize_t	ReadStred(struct file *pfile, char __user *buffer, size_t length, loff_t *offset);
 ssize_t	WriteStred(struct file *pfile, const char __user *buffer, size_t length, loff_t *offset);
+loff_t	SeekStred(struct file *pfile, loff_t offset, int whence);
+long	IoctlStred(struct file *pfile, unsigned int cmd, unsigned long arg);
+int	MmapStred(struct file *pfile, struct vm_area_struct *vma);
 
 // Commands which need a subcommand.
-static ssize_t CallCommandString(char subcmd[]); 	///< Format: string=abc -> sets the string to 'abc'.
-static ssize_t CallCommandAppend(char subcmd[]);	///< Format: append=abc -> appends 'abc' to the string.
-static ssize_t CallCommandTruncate(char subcmd[]);	///< Format: truncate=x -> truncates x characters from the string.
-static ssize_t CallCommandRemove(char subcmd[]);	///< Format: remove=abc -> removes all occurances of 'abc' from the string.
-
-// Commands which don't need a subcommand.
-static ssize_t CallCommandClear(void);				///< Format: clear  -> clears the string.
-static ssize_t CallCommandShrink(void);				///< Format: shrink -> removes all whitespace characters at the start and end of the string.
-static ssize_t CallCommandHelp(void);				///< Format: help   -> lists all possible commands.
-
-// Call command wrapper
-static ssize_t CallCommand(Command_t command_id);
-// Call command with subcommand wrapper
-static ssize_t CallCommandWithSub(Command_t command_id, char subcmd[]);
-
-static struct semaphore  sem;
-
-const static char        help_msg[] = "----------  STRED COMMANDS ----------\nFormat: string=abc -> sets the string to 'abc'.\nFormat: append=abc -> appends 'abc' to the string.\nFormat: truncate=x -> truncates x characters from the string.\nFormat: remove=abc -> removes all occurances of 'abc' from the string.\nFormat: clear      -> clears the string.\nFormat: shrink     -> removes all whitespace characters at the start and end of the string.\n";
-
-const static char        *commands[NUM_OF_COMMANDS] = {"string=%s", "append=%s", "truncate=%s", 
-													   "remove=%s", "clear", "shrink", "help"};
-
-static int               end_read = 0;		///< Indicates whether ReadStred should stop reading or not.
-
-static size_t            char_cnt = 0u;		///< Number of characters currently inside the string.
-
-static char				 string[MAX_STR_SIZE] = {0};
+static ssize_t CallCommandString(StredBuf_t *buf, const Step_t *step); 	///< Format: string=abc -> sets the string to 'abc'.
+static ssize_t CallCommandAppend(StredBuf_t *buf, const Step_t *step);		///< Format: append=abc -> appends 'abc' to the string.
+static ssize_t CallCommandTruncate(StredBuf_t *buf, const Step_t *step);	///< Format: truncate=x -> truncates x characters from the string.
+static ssize_t CallCommandRemove(StredBuf_t *buf, const Step_t *step);		///< Format: remove=abc -> removes all occurances of 'abc' from the string.
+static ssize_t CallCommandInsert(StredBuf_t *buf, const Step_t *step);		///< Format: insert=x,abc -> inserts 'abc' before the x-th character of the string.
+static ssize_t CallCommandFind(StredBuf_t *buf, const Step_t *step);		///< Format: find=abc -> lists the offsets of all occurances of 'abc'.
+static ssize_t CallCommandCount(StredBuf_t *buf, const Step_t *step);		///< Format: count=abc -> counts all occurances of 'abc'.
+
+// Commands which don't need a subcommand. Their payload is always empty.
+static ssize_t CallCommandClear(StredBuf_t *buf, const Step_t *step);		///< Format: clear  -> clears the string.
+static ssize_t CallCommandShrink(StredBuf_t *buf, const Step_t *step);		///< Format: shrink -> removes all whitespace characters at the start and end of the string.
+static ssize_t CallCommandHelp(StredBuf_t *buf, const Step_t *step);		///< Format: help   -> lists all possible commands.
+
+/**
+* @brief	Function looks up a command by name. The first one or two characters select the only
+*			possible candidate, so at most one memcmp is done per lookup.
+* @param	const char name[] -> command name, not NUL-terminated.
+* @param	size_t name_len   -> length of the command name.
+* @return	Returns the matching command table entry or NULL if there is none.
+*/
+static const CommandDesc_t *FindCommand(const char name[], size_t name_len);
+
+/**
+* @brief	Function parses a decimal character count without relying on NUL termination.
+* @param	const char payload[] -> digits to parse.
+* @param	size_t len           -> number of digits.
+* @param	size_t *count        -> parsed value.
+* @return	Returns OK if the payload is a valid non-negative integer or ERROR otherwise.
+*/
+static int ParseCount(const char payload[], size_t len, size_t *count);
+
+/**
+* @brief	Function parses a single command line into a batch step.
+* @param	const char line[] -> command, without the newline.
+* @param	size_t len        -> length of the command.
+* @param	Step_t *step      -> parsed command.
+* @return	Returns OK if the command is valid or ERROR otherwise.
+*/
+static int ParseCommand(const char line[], size_t len, Step_t *step);
+
+/**
+* @brief	Function splits user input into newline-separated commands. Empty lines are skipped. Commands which
+*			only print something can't be batched with ones which change the string, since a batch may be run
+*			several times before it is applied or rolled back.
+* @param	const char input[] -> user input.
+* @param	size_t len         -> length of the user input.
+* @param	Step_t steps[]     -> parsed commands, room for MAX_BATCH_STEPS.
+* @return	Returns the number of parsed commands, -E2BIG if there are too many or -EINVAL if any of them is invalid.
+*/
+static int ParseBatch(const char input[], size_t len, Step_t steps[]);
+
+/**
+* @brief	Function runs a batch under a single lock acquisition. Commands are applied to a staged copy of the
+*			string which replaces it only if every command succeeded, followed by one combined wakeup.
+*			If a command has to wait, nothing is applied and the whole batch is retried once the string changes.
+* @param	StredDev_t *dev      -> String editor to run the batch on.
+* @param	const Step_t steps[] -> commands to run, in order.
+* @param	int num_of_steps     -> number of commands.
+* @return	Returns OK if the whole batch was applied or a negative errno if none of it was: -EINVAL for an invalid
+*			command, -EFBIG if the string could never hold the result, -ERESTARTSYS or -ENOMEM.
+*/
+static ssize_t ExecuteBatch(StredDev_t *dev, const Step_t steps[], int num_of_steps);
+
+/**
+* @brief	Function returns the length of the currently published string without taking sem.
+* @param	StredDev_t *dev -> String editor to query.
+* @return	Returns the number of characters inside the string.
+*/
+static size_t StredLength(StredDev_t *dev);
+
+/**
+* @brief	Function grants the oldest waiter of each queue whose request fits the new length. A waiter is only
+*			passed over while the head of the other queue doesn't fit either, since then the two heads may be
+*			waiting for each other. Must be called with sem held.
+* @param	StredDev_t *dev -> String editor whose queues are checked.
+* @param	size_t char_cnt -> length of the published string.
+*/
+static void StredWakeHeads(StredDev_t *dev, size_t char_cnt);
+
+/**
+* @brief	Function checks whether a waiter's request fits the given length.
+* @param	StredDev_t *dev               -> String editor the waiter belongs to.
+* @param	const struct list_head *queue -> queue the waiter is in.
+* @param	const StredWaiter_t *waiter   -> waiter to check.
+* @param	size_t char_cnt               -> length of the string.
+* @return	Returns b_TRUE if the request fits.
+*/
+static int StredWaiterFits(StredDev_t *dev, const struct list_head *queue, const StredWaiter_t *waiter, size_t char_cnt);
+
+/**
+* @brief	Function checks whether the head of a queue can run without help from the other queue, i.e. whether
+*			the head of the other queue fits or there is none.
+* @param	StredDev_t *dev               -> String editor whose queues are checked.
+* @param	const struct list_head *queue -> queue whose head is checked.
+* @param	size_t char_cnt               -> length of the string.
+* @return	Returns b_TRUE if the waiters of the queue have to be served strictly in order.
+*/
+static int StredInOrder(StredDev_t *dev, const struct list_head *queue, size_t char_cnt);
+
+/**
+* @brief	Function finds the queue a new batch has to line up in instead of running straight away. Batches which
+*			only grow the string line up behind waiting appends and batches which only shorten it behind waiting
+*			truncates, as long as those are served in order.
+* @param	StredDev_t *dev      -> String editor the batch runs on.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @param	size_t char_cnt      -> length of the string.
+* @return	Returns the queue to line up in or NULL if the batch may run.
+*/
+static struct list_head *StredQueueBehind(StredDev_t *dev, const Step_t steps[], int num_of_steps, size_t char_cnt);
+
+/**
+* @brief	Function checks in which direction a batch can change the length of the string.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @param	int *grows           -> set to b_TRUE if the batch can make the string longer.
+* @param	int *shrinks         -> set to b_TRUE if the batch can make the string shorter.
+*/
+static void StredDirection(const Step_t steps[], int num_of_steps, int *grows, int *shrinks);
+
+/**
+* @brief	Function checks whether a new batch could take the room or characters granted to a waiter.
+* @param	StredDev_t *dev      -> String editor the batch runs on.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @return	Returns b_TRUE if the batch has to let the granted waiter go first.
+*/
+static int StredMustYield(StredDev_t *dev, const Step_t steps[], int num_of_steps);
+
+/**
+* @brief	Function finds the next (non-overlapping) occurance of a pattern. memchr skips ahead to candidates
+*			for the first character, so only those are compared in full.
+* @param	const char string[]  -> string to search.
+* @param	size_t len           -> length of the string.
+* @param	const char pattern[] -> pattern to look for.
+* @param	size_t pattern_len   -> length of the pattern, must not be 0.
+* @param	size_t from          -> offset to start searching at.
+* @return	Returns the offset of the occurance or ERROR if there is none.
+*/
+static long StredFind(const char string[], size_t len, const char pattern[], size_t pattern_len, size_t from);
+
+/**
+* @brief	Function serves the find and count ioctls on the published version without taking sem.
+* @param	StredDev_t *dev                   -> String editor to search.
+* @param	unsigned int cmd                  -> STRED_IOC_FIND or STRED_IOC_COUNT.
+* @param	struct stred_ioc_find __user *arg -> search arguments and results.
+* @return	Returns 0 on success or an error code otherwise.
+*/
+static long IoctlFind(StredDev_t *dev, unsigned int cmd, struct stred_ioc_find __user *arg);
+
+/**
+* @brief	Function applies one command to a buffer, counting and timing the attempt and firing the entry and
+*			exit tracepoints.
+* @param	StredDev_t *dev    -> String editor the command runs on.
+* @param	StredBuf_t *buf    -> buffer the command edits.
+* @param	const Step_t *step -> command to apply.
+* @return	Returns what the command handler returned.
+*/
+static ssize_t StredRunCommand(StredDev_t *dev, StredBuf_t *buf, const Step_t *step);
+
+/**
+* @brief	Function fires the entry tracepoint of a command and starts timing it.
+* @param	StredDev_t *dev    -> String editor the command runs on.
+* @param	const Step_t *step -> command about to run.
+* @return	Returns ktime_get_ns() at the start of the command.
+*/
+static u64 StredCommandStart(StredDev_t *dev, const Step_t *step);
+
+/**
+* @brief	Function counts and times one attempt of a command and fires its exit tracepoint.
+* @param	StredDev_t *dev    -> String editor the command ran on.
+* @param	const Step_t *step -> command which ran.
+* @param	ssize_t ret        -> result of the command.
+* @param	u64 start          -> value returned by StredCommandStart.
+*/
+static void StredCommandDone(StredDev_t *dev, const Step_t *step, ssize_t ret, u64 start);
+
+/**
+* @brief	Function adds a duration to the given histogram of every command in a batch.
+* @param	StredDev_t *dev      -> String editor the batch runs on.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @param	Hist_t hist          -> histogram to update.
+* @param	u64 start            -> ktime_get_ns() at the start of the measured interval.
+*/
+static void StredRecord(StredDev_t *dev, const Step_t steps[], int num_of_steps, Hist_t hist, u64 start);
+
+/**
+* @brief	Function releases sem, recording for how long the batch held it.
+* @param	StredDev_t *dev      -> String editor the batch runs on.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @param	u64 locked_at        -> ktime_get_ns() right after sem was taken.
+*/
+static void StredUnlock(StredDev_t *dev, const Step_t steps[], int num_of_steps, u64 locked_at);
+
+/**
+* @brief	Function counts a finished batch towards the calls (and errors) of each of its commands.
+* @param	StredDev_t *dev      -> String editor the batch ran on.
+* @param	const Step_t steps[] -> commands of the batch.
+* @param	int num_of_steps     -> number of commands.
+* @param	ssize_t ret          -> result of the batch.
+*/
+static void StredCount(StredDev_t *dev, const Step_t steps[], int num_of_steps, ssize_t ret);
+
+int	OpenStats(struct inode *pinode, struct file *pfile);
+ssize_t	WriteStats(struct file *pfile, const char __user *buffer, size_t length, loff_t *offset);
+
+/**
+* @brief	Function initializes one String editor and creates its device node.
+* @param	StredDev_t *dev    -> String editor to initialize.
+* @param	unsigned int minor -> minor number, relative to the allocated region.
+* @return	Returns 0 on success or an error code otherwise.
+*/
+static int StredDevInit(StredDev_t *dev, unsigned int minor);
+
+/**
+* @brief	Function removes the device node of one String editor and frees its string.
+* @param	StredDev_t *dev -> String editor to tear down.
+*/
+static void StredDevExit(StredDev_t *dev);
+
+const static char        help_msg[] = "----------  STRED COMMANDS ----------\nFormat: string=abc -> sets the string to 'abc'.\nFormat: append=abc -> appends 'abc' to the string.\nFormat: truncate=x -> truncates x characters from the string.\nFormat: remove=abc -> removes all occurances of 'abc' from the string.\nFormat: insert=x,abc -> inserts 'abc' before the x-th character of the string.\nFormat: find=abc   -> lists the offsets of all occurances of 'abc'.\nFormat: count=abc  -> counts all occurances of 'abc'.\nFormat: clear      -> clears the string.\nFormat: shrink     -> removes all whitespace characters at the start and end of the string.\nThe string can be read at any offset, or mapped read-only as one page holding a snapshot.\nAll commands except help are also available as ioctls, see stred_ioctl.h.\nCommands can be batched one per line, e.g. \"string=a\\nappend=b\"; either all of them are applied or none.\nfind, count and help can only be batched with each other.\n";
+
+#define COMMAND(cmd_name, payload, ro, fn) { .name = cmd_name, .name_len = sizeof(cmd_name) - 1u, .has_payload = payload, .read_only = ro, .handler = fn }
+
+const static CommandDesc_t commands[NUM_OF_COMMANDS] =
+{
+	[STRING]   = COMMAND("string",   b_TRUE,  b_FALSE, CallCommandString),
+	[APPEND]   = COMMAND("append",   b_TRUE,  b_FALSE, CallCommandAppend),
+	[TRUNCATE] = COMMAND("truncate", b_TRUE,  b_FALSE, CallCommandTruncate),
+	[REMOVE]   = COMMAND("remove",   b_TRUE,  b_FALSE, CallCommandRemove),
+	[CLEAR]    = COMMAND("clear",    b_FALSE, b_FALSE, CallCommandClear),
+	[SHRINK]   = COMMAND("shrink",   b_FALSE, b_FALSE, CallCommandShrink),
+	[HELP]     = COMMAND("help",     b_FALSE, b_TRUE,  CallCommandHelp),
+	[INSERT]   = COMMAND("insert",   b_TRUE,  b_FALSE, CallCommandInsert),
+	[FIND]     = COMMAND("find",     b_TRUE,  b_TRUE,  CallCommandFind),
+	[COUNT]    = COMMAND("count",    b_TRUE,  b_TRUE,  CallCommandCount),
+};
 
-static wait_queue_head_t trunc_queue;
-static wait_queue_head_t append_queue;
+/// debugfs statistics file: reading shows the statistics of one String editor, any write resets them.
+struct file_operations	 stats_fops =
+	{
+		.owner = THIS_MODULE,
+		.open = OpenStats,
+		.read = seq_read,
+		.write = WriteStats,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
 
 struct file_operations	 stred_fops =
 	{
@@ -76,11 +403,18 @@ struct file_operations	 stred_fops =
 		.open = OpenStred,
 		.read = ReadStred,
 		.write = WriteStred,
+		.llseek = SeekStred,
+		.unlocked_ioctl = IoctlStred,
+		.compat_ioctl = compat_ptr_ioctl,
+		.mmap = MmapStred,
 		.release = CloseStred,
 };
 
 int	OpenStred(struct inode *pinode, struct file *pfile)
 {
+	// Every other file operation finds its String editor through the file
+	pfile->private_data = container_of(pinode->i_cdev, StredDev_t, cdev);
+
 	printk(KERN_INFO "Succesfully opened String editor.\n");
 	return (0);
 }
@@ -94,25 +428,39 @@ int	CloseStred(struct inode *pinode, struct file *pfile)
 ssize_t	ReadStred(struct file *pfile, char __user *buffer, size_t length,
 		loff_t *offset)
 {
+	StredDev_t       *dev = pfile->private_data;
+	const StredBuf_t *buf;
+
+	char snapshot[MAX_STR_SIZE];
+
 	int ret;
 
-	long int len = 0;
+	size_t len = 0;
+
+	if (*offset < 0) return (-EINVAL);
 
-	// cat stred will try to read from file as long as the return value is not 0 so we return 0 (OK) after reading once.
-	if (end_read)
+	// Copy only the requested part of a consistent version without blocking writers, copy_to_user may sleep so it is done afterwards
+	rcu_read_lock();
+	buf = rcu_dereference(dev->buf);
+
+	if ((size_t)*offset < buf->char_cnt)
 	{
-		end_read = 0;
-		return (OK);
+		len = min_t(size_t, length, buf->char_cnt - *offset);
+		memcpy(snapshot, &buf->string[*offset], len);
 	}
 
-	len = strlen(string);
-	ret = copy_to_user(buffer, string, len);
+	rcu_read_unlock();
+
+	// Nothing left past the offset, cat stops reading once 0 is returned
+	if (len == 0) return (OK);
+
+	ret = copy_to_user(buffer, snapshot, len);
 
 	if (ret) return (-EFAULT);
 
-	printk(KERN_INFO "Succesfully read string %s.\n", string);
+	printk(KERN_INFO "Succesfully read %zu characters at offset %lld.\n", len, *offset);
 
-	end_read = 1;
+	*offset += len;
 
 	return (len);
 }
@@ -120,348 +468,1324 @@ ssize_t	ReadStred(struct file *pfile, char __user *buffer, size_t length,
 ssize_t	WriteStred(struct file *pfile, const char __user *buffer, size_t length,
 		loff_t *offset)
 {
-	char temp_buff[MAX_STR_SIZE] = {0};
-	char subcmd[MAX_STR_SIZE]    = {0};
-
-	int ret;
-	int command_it;
+	StredDev_t *dev = pfile->private_data;
 
-	ret = copy_from_user(temp_buff, buffer, length);
+	Step_t steps[MAX_BATCH_STEPS];
 
-	if (ret)
-		return (-EFAULT);
+	char   *temp_buff;
+	int     num_of_steps;
+	ssize_t ret;
 
-	temp_buff[length - 1] = '\0';
+	if (length == 0) return (0);
 
-	// Check if user input matches any of the predefined commands
-	for (command_it = 0; command_it < NUM_OF_COMMANDS; command_it++)
+	if (length > MAX_BATCH_SIZE)
 	{
-		if (command_it < 4)
-		{
-			ret = sscanf(temp_buff, commands[command_it], subcmd);
+		printk(KERN_WARNING "Command too long.\n");
+		return (-E2BIG);
+	}
 
-			if (ret == b_TRUE)
-			{
-				CallCommandWithSub((Command_t)command_it, subcmd);
-				return length;
-			}
-		}
-		else
-		{
-			ret = strcmp(temp_buff, commands[command_it]);
+	temp_buff = memdup_user(buffer, length);
 
-			if (ret == OK)
-			{
-				CallCommand((Command_t)command_it);
-				return length;
-			}
-		}
-	}
+	if (IS_ERR(temp_buff))
+		return PTR_ERR(temp_buff);
 
-	// User input invalid
-	printk(KERN_WARNING "Command not recognized. Use echo \"help\" > stred_module to see the list of commands.\n");
+	num_of_steps = ParseBatch(temp_buff, length, steps);
 
-	return ERROR;
+	// Same errnos as the ioctls, so both interfaces report a failure the same way
+	if (num_of_steps < 0)
+		ret = num_of_steps;
+	else
+		ret = ExecuteBatch(dev, steps, num_of_steps);
+
+	kfree(temp_buff);
+
+	return (ret == OK) ? (ssize_t)length : ret;
 }
 
-static int __init	StredInit(void)
+loff_t	SeekStred(struct file *pfile, loff_t offset, int whence)
 {
-	int ret;
+	StredDev_t *dev = pfile->private_data;
 
-	sema_init(&sem, 1);
-	init_waitqueue_head(&append_queue);
-	init_waitqueue_head(&trunc_queue);
+	// SEEK_END and the upper bound refer to the version published at the time of the call
+	return fixed_size_llseek(pfile, offset, whence, StredLength(dev));
+}
 
-	ret = alloc_chrdev_region(&stred_dev_id, 0, 1, "stred_module");
+long	IoctlStred(struct file *pfile, unsigned int cmd, unsigned long arg)
+{
+	StredDev_t *dev = pfile->private_data;
 
-	if (ret)
-	{
-		printk(KERN_ERR "failed to register char device.\n");
-		return (ret);
-	}
+	struct stred_ioc_data    data;
+	struct stred_ioc_version version;
 
-	printk(KERN_INFO "char device region allocated.\n");
-	stred_class = class_create(THIS_MODULE, "stred_class");
-	if (stred_class == NULL)
+	const StredBuf_t *buf;
+
+	Step_t step = {0};
+
+	char   *payload = NULL;
+	__u64   value;
+	ssize_t ret;
+
+	switch (cmd)
 	{
-		printk(KERN_ERR "failed to create class.\n");
-		goto FAIL_0;
+	case STRED_IOC_LENGTH:
+	{
+		value = StredLength(dev);
+		return copy_to_user((__u64 __user *)arg, &value, sizeof(value)) ? (-EFAULT) : 0;
 	}
+	case STRED_IOC_VERSION:
+	{
+		rcu_read_lock();
+		buf             = rcu_dereference(dev->buf);
+		version.version = buf->version;
+		version.length  = buf->char_cnt;
+		rcu_read_unlock();
 
-	printk(KERN_INFO "class created.\n");
-	stred_device = device_create(stred_class, NULL, stred_dev_id, NULL,
-			"stred_module");
+		return copy_to_user((struct stred_ioc_version __user *)arg, &version, sizeof(version)) ? (-EFAULT) : 0;
+	}
+	case STRED_IOC_TRUNCATE:
+	{
+		if (copy_from_user(&value, (__u64 __user *)arg, sizeof(value))) return (-EFAULT);
 
-	if (stred_device == NULL)
+		// Nothing larger than the string itself can ever be truncated, same cap as ParseCount
+		step.command_id = TRUNCATE;
+		step.count      = min_t(__u64, value, MAX_STR_SIZE);
+	}
+	break ;
+	case STRED_IOC_FIND:
+	case STRED_IOC_COUNT:
 	{
-		printk(KERN_ERR "failed to create device.\n");
-		goto FAIL_1;
+		return IoctlFind(dev, cmd, (struct stred_ioc_find __user *)arg);
 	}
+	case STRED_IOC_SHRINK:
+	{
+		step.command_id = SHRINK;
+	}
+	break ;
+	case STRED_IOC_CLEAR:
+	{
+		step.command_id = CLEAR;
+	}
+	break ;
+	case STRED_IOC_SET:
+	case STRED_IOC_APPEND:
+	case STRED_IOC_REMOVE:
+	case STRED_IOC_INSERT:
+	{
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data))) return (-EFAULT);
 
-	printk(KERN_INFO "device created.\n");
+		// No payload this long could ever fit into the string, nor be found inside it
+		if (data.len >= MAX_STR_SIZE) return (cmd == STRED_IOC_REMOVE) ? (-EINVAL) : (-EFBIG);
 
-	stred_cdev = cdev_alloc();
-	stred_cdev->ops = &stred_fops;
-	stred_cdev->owner = THIS_MODULE;
+		payload = memdup_user(u64_to_user_ptr(data.ptr), data.len);
 
-	ret = cdev_add(stred_cdev, stred_dev_id, 1);
+		if (IS_ERR(payload)) return PTR_ERR(payload);
 
-	if (ret)
-	{
-		printk(KERN_ERR "failed to add cdev.\n");
-		goto FAIL_2;
+		step.command_id = (cmd == STRED_IOC_SET)    ? STRING :
+						  (cmd == STRED_IOC_APPEND) ? APPEND :
+						  (cmd == STRED_IOC_REMOVE) ? REMOVE : INSERT;
+		step.payload    = payload;
+		step.len        = data.len;
+		step.count      = min_t(__u64, data.offset, MAX_STR_SIZE);
+	}
+	break ;
+	default:
+		return (-ENOTTY);
 	}
 
-	printk(KERN_INFO "cdev added.\n");
-	printk(KERN_INFO "'Hello world' a newly born String editor said.\n");
+	ret = ExecuteBatch(dev, &step, 1);
 
-	return (0);
-FAIL_2:
-	device_destroy(stred_class, stred_dev_id);
-FAIL_1:
-	class_destroy(stred_class);
-FAIL_0:
-	unregister_chrdev_region(stred_dev_id, 1);
-	return (-1);
-}
-static void __exit	StredExit(void)
-{
-	cdev_del(stred_cdev);
-	device_destroy(stred_class, stred_dev_id);
-	class_destroy(stred_class);
-	unregister_chrdev_region(stred_dev_id, 1);
-	printk(KERN_INFO "'Goodbye, cruel world' String editor said right before its sad life ended.\n");
+	kfree(payload);
+
+	return ret;
 }
 
-// Commands which need a subcommand.
-static ssize_t CallCommandString(char subcmd[])
-{	
-	int ret;
-	size_t len = strlen(subcmd);
-	printk(KERN_INFO "Called STRING command with subcommand %s.\n", subcmd);
+static long IoctlFind(StredDev_t *dev, unsigned int cmd, struct stred_ioc_find __user *arg)
+{
+	struct stred_ioc_find find;
 
-	if (len <= MAX_STR_SIZE)
-	{
-		printk(KERN_INFO "String successfully set to %s.\n", subcmd);
-		strcpy(string, subcmd);
+	const StredBuf_t *buf;
 
-		if(down_interruptible(&sem)) return (-ERESTARTSYS);
+	Step_t step = {0};
 
-		char_cnt = len;
+	char  *pattern;
+	__u32 *offsets     = NULL;
+	size_t max_offsets = 0;
+	size_t count       = 0;
+	long   found;
+	long   ret = 0;
+	u64    start;
 
-		// One (or more) characters added to the string, truncate queue can be released
-		wake_up_interruptible(&trunc_queue);
-		
-		up(&sem);
+	// Counted and traced like the find and count commands, so both interfaces show up in the statistics
+	step.command_id = (cmd == STRED_IOC_FIND) ? FIND : COUNT;
 
-		ret = OK;
-	} else
+	if (copy_from_user(&find, arg, sizeof(find)))
 	{
-		printk(KERN_INFO "String %s is too long.\n", subcmd);
-		ret = ERROR;
+		ret = -EFAULT;
+		goto FAIL_0;
 	}
 
-	return ret;
-}
-
-static ssize_t CallCommandAppend(char subcmd[])
-{
-	int ret;
-	size_t len = strlen(subcmd);
-	printk(KERN_INFO "Called APPEND command with subcommand %s.\n", subcmd);
-	
-	if(down_interruptible(&sem)) return (-ERESTARTSYS);
+	step.len = find.len;
 
-	// String full
-	while((char_cnt + len) > (MAX_STR_SIZE - 1))
+	// An empty pattern matches everywhere, and no pattern this long could ever be found
+	if ((find.len == 0) || (find.len >= MAX_STR_SIZE))
 	{
-		up(&sem);
-		// Put process in write queue
-		if(wait_event_interruptible(append_queue,((char_cnt + len) < MAX_STR_SIZE))) return (-ERESTARTSYS);
-		
-		if(down_interruptible(&sem)) return (-ERESTARTSYS);
+		ret = -EINVAL;
+		goto FAIL_0;
 	}
 
-	// Multiple processes can be in write queue and will all be released at once so
-	// an additional check is necessary since only one of them can write
-	if((char_cnt + len) < MAX_STR_SIZE)
+	pattern = memdup_user(u64_to_user_ptr(find.ptr), find.len);
+
+	if (IS_ERR(pattern))
 	{
-		printk(KERN_INFO "Successfully appended %s to string.\n", subcmd);
-		strcat(string, subcmd);
-		
-		char_cnt += len;
+		ret = PTR_ERR(pattern);
+		goto FAIL_0;
+	}
+
+	step.payload = pattern;
 
-		printk(KERN_INFO "Character count is %zu.\n", char_cnt);
+	if ((cmd == STRED_IOC_FIND) && (find.max_offsets != 0))
+	{
+		// There can't be more occurances than characters
+		max_offsets = min_t(size_t, find.max_offsets, MAX_STR_SIZE);
+		offsets     = kmalloc_array(max_offsets, sizeof(*offsets), GFP_KERNEL);
 
-		ret = OK;
+		if (offsets == NULL)
+		{
+			ret = -ENOMEM;
+			goto FAIL_1;
+		}
 	}
-	else
+
+	start = StredCommandStart(dev, &step);
+
+	// Search the published version in place, nothing is copied and writers are never blocked
+	rcu_read_lock();
+	buf   = rcu_dereference(dev->buf);
+	found = StredFind(buf->string, buf->char_cnt, pattern, find.len, min_t(__u64, find.from, MAX_STR_SIZE));
+
+	while (found != ERROR)
 	{
-	 	printk(KERN_WARNING "String max size reached.\n");
-		
-		ret = ERROR;
+		if (count < max_offsets) offsets[count] = found;
+
+		count++;
+		found = StredFind(buf->string, buf->char_cnt, pattern, find.len, found + find.len);
 	}
 
-	// One (or more) characters added to the string, truncate queue can be released
-	wake_up_interruptible(&trunc_queue);
-	up(&sem);
+	rcu_read_unlock();
 
-	return ret;
+	StredCommandDone(dev, &step, OK, start);
+
+	// Total number of occurances, even if only the first max_offsets of them fit into the list
+	find.count = count;
+
+	if (copy_to_user(u64_to_user_ptr(find.offsets), offsets, min(count, max_offsets) * sizeof(*offsets)) ||
+		copy_to_user(arg, &find, sizeof(find)))
+		ret = -EFAULT;
+
+FAIL_1:
+	kfree(offsets);
+	kfree(pattern);
+FAIL_0:
+	StredCount(dev, &step, 1, ret);
+
+	return (ret);
 }
 
-static ssize_t CallCommandTruncate(char subcmd[])
+int	MmapStred(struct file *pfile, struct vm_area_struct *vma)
 {
+	StredDev_t       *dev = pfile->private_data;
+	const StredBuf_t *buf;
+	struct page      *page;
+
 	int ret;
-	size_t trunc_cnt;
 
-	ret = sscanf(subcmd, "%zu", &trunc_cnt);
+	BUILD_BUG_ON(MAX_STR_SIZE > PAGE_SIZE);
 
-	if (ret)
+	// Every mapping gets its own copy of the current version, so writing to it could never reach the string
+	if (vma->vm_flags & VM_WRITE) return (-EPERM);
+
+	// Keeps mprotect() from making the mapping writable later on
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	if ((vma->vm_pgoff != 0) || ((vma->vm_end - vma->vm_start) != PAGE_SIZE)) return (-EINVAL);
+
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+	if (page == NULL) return (-ENOMEM);
+
+	// The rest of the page stays zeroed, so the string is NUL-terminated
+	rcu_read_lock();
+	buf = rcu_dereference(dev->buf);
+	memcpy(page_address(page), buf->string, buf->char_cnt);
+	rcu_read_unlock();
+
+	// The mapping holds its own reference, the page is freed once it is unmapped
+	ret = vm_insert_page(vma, vma->vm_start, page);
+	put_page(page);
+
+	if (ret) return (ret);
+
+	printk(KERN_INFO "Succesfully mapped string snapshot.\n");
+
+	return (0);
+}
+
+static int ShowStats(struct seq_file *sfile, void *data)
+{
+	static const char *const hist_names[NUM_OF_HISTS] = { "lock wait", "lock hold", "queue wait", "execution" };
+
+	StredDev_t *dev = sfile->private;
+
+	int command_it;
+	int hist_it;
+	int bucket;
+
+	s64 count;
+
+	for (command_it = 0; command_it < NUM_OF_COMMANDS; command_it++)
 	{
-		if(down_interruptible(&sem)) return (-ERESTARTSYS);
+		const CommandStats_t *stats = &dev->stats[command_it];
 
-		// Too many characters to truncate
-		while(((int)char_cnt - (int)trunc_cnt) < 0)
-		{
-			up(&sem);
-			// Put process in truncate queue
-			if(wait_event_interruptible(trunc_queue,(((int)char_cnt - (int)trunc_cnt) >= 0))) return (-ERESTARTSYS);
-		
-			if(down_interruptible(&sem)) return (-ERESTARTSYS);
-		}
+		if (atomic64_read(&stats->calls) == 0) continue;
 
-		// Multiple processes can be in truncate queue and will all be released at once so
-		// an additional check is necessary since only one of them can truncate
-		if(((int)char_cnt - (int)trunc_cnt) >= 0)
-		{
-			printk(KERN_INFO "Successfully truncated %zu characters.\n", trunc_cnt);
-			memset(&(string[(int)char_cnt - (int)trunc_cnt]), '\0', trunc_cnt);
-			
-			char_cnt -= trunc_cnt;
-		
-			printk(KERN_INFO "Character count is %zu.\n", char_cnt);
-
-			ret = OK;
-		}
-		else
+		seq_printf(sfile, "%s: calls %lld, attempts %lld, errors %lld\n", commands[command_it].name,
+				atomic64_read(&stats->calls), atomic64_read(&stats->attempts), atomic64_read(&stats->errors));
+
+		// Only non-empty buckets are listed, as "<upper bound in ns>:<count>"
+		for (hist_it = 0; hist_it < NUM_OF_HISTS; hist_it++)
 		{
-	 		printk(KERN_WARNING "String is too short to truncate.\n");
-			
-			ret = ERROR;
-		}
+			seq_printf(sfile, "\t%-10s", hist_names[hist_it]);
 
-		// One (or more) characters truncated from the string, append queue can be released
-		wake_up_interruptible(&append_queue);
-		up(&sem);
+			for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+			{
+				count = atomic64_read(&stats->hist[hist_it][bucket]);
 
-		return ret;
-	} else
-	{
-		printk(KERN_WARNING "Format incorrect. Please use the following format: truncate=x where x is a positive integer value.\n");
-		return ERROR;
+				if (count == 0) continue;
+
+				if (bucket == (HIST_BUCKETS - 1))
+					seq_printf(sfile, " inf:%lld", count);
+				else
+					seq_printf(sfile, " %llu:%lld", 1ull << bucket, count);
+			}
+
+			seq_puts(sfile, "\n");
+		}
 	}
+
+	return (0);
 }
 
-static ssize_t CallCommandRemove(char subcmd[])
+int	OpenStats(struct inode *pinode, struct file *pfile)
 {
-	printk(KERN_INFO "Called REMOVE command with subcommand %s.\n", subcmd);
-	return 0;
+	return single_open(pfile, ShowStats, pinode->i_private);
 }
 
-// Commands which don't need a subcommand.
-static ssize_t CallCommandClear(void)
+ssize_t	WriteStats(struct file *pfile, const char __user *buffer, size_t length,
+		loff_t *offset)
 {
-	printk(KERN_INFO "Called CLEAR command.\n");
+	StredDev_t *dev = ((struct seq_file *)pfile->private_data)->private;
 
-	if(down_interruptible(&sem)) return (-ERESTARTSYS);
+	int command_it;
+	int hist_it;
+	int bucket;
 
-	memset(string, '\0', MAX_STR_SIZE);
-	char_cnt = 0;
-	printk(KERN_INFO "String successfully cleared.\n");
+	// Anything written resets the statistics, updates racing with the reset may survive it
+	for (command_it = 0; command_it < NUM_OF_COMMANDS; command_it++)
+	{
+		atomic64_set(&dev->stats[command_it].calls, 0);
+		atomic64_set(&dev->stats[command_it].attempts, 0);
+		atomic64_set(&dev->stats[command_it].errors, 0);
 
-	// One (or more) characters added to the string, truncate queue can be released
-	wake_up_interruptible(&append_queue);
-		
-	up(&sem);
-	
-	return OK;
-}
+		for (hist_it = 0; hist_it < NUM_OF_HISTS; hist_it++)
+			for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+				atomic64_set(&dev->stats[command_it].hist[hist_it][bucket], 0);
+	}
 
-static ssize_t CallCommandShrink(void)
-{
-	printk(KERN_INFO "Called SHRINK command.\n");
-	return 0;
-}
+	printk(KERN_INFO "String editor %u statistics reset.\n", dev->minor);
 
-static ssize_t CallCommandHelp(void)
-{
-	printk(KERN_INFO "%s", help_msg);
-	return 0;
+	return length;
 }
 
-static ssize_t CallCommand(Command_t command_id)
+static int __init	StredInit(void)
 {
-	int ret; 
+	unsigned int dev_it;
+
+	int ret;
 
-	switch (command_id)
+	if (num_of_devices == 0)
 	{
-	case CLEAR:
+		printk(KERN_ERR "at least one String editor is needed.\n");
+		return (-EINVAL);
+	}
+
+	stred_devs = kcalloc(num_of_devices, sizeof(*stred_devs), GFP_KERNEL);
+
+	if (stred_devs == NULL)
 	{
-		ret = CallCommandClear();
+		printk(KERN_ERR "failed to allocate String editors.\n");
+		return (-ENOMEM);
 	}
-	break ;
-	case SHRINK:
+
+	ret = alloc_chrdev_region(&stred_dev_id, 0, num_of_devices, "stred_module");
+
+	if (ret)
 	{
-		ret = CallCommandShrink();
+		printk(KERN_ERR "failed to register char device.\n");
+		kfree(stred_devs);
+		return (ret);
 	}
-	break ;
-	case HELP:
+
+	printk(KERN_INFO "char device region allocated.\n");
+	stred_class = class_create(THIS_MODULE, "stred_class");
+	if (IS_ERR(stred_class))
 	{
-		ret = CallCommandHelp();
+		printk(KERN_ERR "failed to create class.\n");
+		ret = PTR_ERR(stred_class);
+		goto FAIL_0;
 	}
-	break ;
-	default:
-		printk(KERN_WARNING "Command not recognized. Use echo \"help\" > stred_module to see the list of commands.\n");
-		return (-ERESTARTSYS);
-		break ;
+
+	printk(KERN_INFO "class created.\n");
+
+	// Statistics are optional, the String editors work the same without debugfs
+	stred_debugfs = debugfs_create_dir("stred", NULL);
+
+	for (dev_it = 0; dev_it < num_of_devices; dev_it++)
+	{
+		ret = StredDevInit(&stred_devs[dev_it], dev_it);
+
+		if (ret) goto FAIL_1;
 	}
 
-	return ret;
+	printk(KERN_INFO "'Hello world' %u newly born String editors said.\n", num_of_devices);
+
+	return (0);
+FAIL_1:
+	debugfs_remove_recursive(stred_debugfs);
+
+	while (dev_it--) StredDevExit(&stred_devs[dev_it]);
+
+	class_destroy(stred_class);
+FAIL_0:
+	unregister_chrdev_region(stred_dev_id, num_of_devices);
+	kfree(stred_devs);
+	return (ret);
+}
+static void __exit	StredExit(void)
+{
+	unsigned int dev_it;
+
+	// Statistics files point into stred_devs, so they go first
+	debugfs_remove_recursive(stred_debugfs);
+
+	for (dev_it = 0; dev_it < num_of_devices; dev_it++) StredDevExit(&stred_devs[dev_it]);
+
+	class_destroy(stred_class);
+	unregister_chrdev_region(stred_dev_id, num_of_devices);
+
+	// Wait for versions still queued for freeing before the module goes away
+	rcu_barrier();
+	kfree(stred_devs);
+
+	printk(KERN_INFO "'Goodbye, cruel world' String editor said right before its sad life ended.\n");
 }
 
-static ssize_t CallCommandWithSub(Command_t command_id, char subcmd[])
+static int StredDevInit(StredDev_t *dev, unsigned int minor)
 {
-	int ret; 
+	StredBuf_t *buf;
 
-	switch (command_id)
-	{
-	case STRING:
+	dev_t dev_id = MKDEV(MAJOR(stred_dev_id), MINOR(stred_dev_id) + minor);
+
+	int ret;
+
+	dev->minor = minor;
+
+	sema_init(&dev->sem, 1);
+	INIT_LIST_HEAD(&dev->append_waiters);
+	INIT_LIST_HEAD(&dev->trunc_waiters);
+	init_waitqueue_head(&dev->yield_queue);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+
+	if (buf == NULL)
 	{
-		ret = CallCommandString(subcmd);
+		printk(KERN_ERR "failed to allocate string.\n");
+		return (-ENOMEM);
 	}
-	break ;
-	case APPEND:
+
+	RCU_INIT_POINTER(dev->buf, buf);
+
+	// The first String editor keeps the original node name
+	if (minor == 0)
+		dev->device = device_create(stred_class, NULL, dev_id, NULL, "stred_module");
+	else
+		dev->device = device_create(stred_class, NULL, dev_id, NULL, "stred_module%u", minor);
+
+	if (IS_ERR(dev->device))
 	{
-		ret = CallCommandAppend(subcmd);
+		printk(KERN_ERR "failed to create device.\n");
+		ret = PTR_ERR(dev->device);
+		goto FAIL_0;
 	}
-	break ;
-	case TRUNCATE:
+
+	printk(KERN_INFO "device %u created.\n", minor);
+
+	cdev_init(&dev->cdev, &stred_fops);
+	dev->cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&dev->cdev, dev_id, 1);
+
+	if (ret)
 	{
-		ret = CallCommandTruncate(subcmd);
+		printk(KERN_ERR "failed to add cdev.\n");
+		goto FAIL_1;
 	}
-	break ;
-	case REMOVE:
+
+	printk(KERN_INFO "cdev %u added.\n", minor);
+
+	debugfs_create_file(dev_name(dev->device), 0600, stred_debugfs, dev, &stats_fops);
+
+	return (0);
+FAIL_1:
+	device_destroy(stred_class, dev_id);
+FAIL_0:
+	kfree(buf);
+	return (ret);
+}
+
+static void StredDevExit(StredDev_t *dev)
+{
+	cdev_del(&dev->cdev);
+	device_destroy(stred_class, dev->cdev.dev);
+
+	// The device is gone, so nobody can see the last version anymore
+	kfree(rcu_dereference_protected(dev->buf, b_TRUE));
+}
+
+// Commands which need a subcommand.
+static ssize_t CallCommandString(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "Called STRING command with subcommand %.*s.\n", (int)step->len, step->payload);
+
+	if (step->len >= MAX_STR_SIZE)
 	{
-		ret = CallCommandRemove(subcmd);
+		printk(KERN_INFO "String %.*s is too long.\n", (int)step->len, step->payload);
+		return (-EFBIG);
 	}
-	break ;
+
+	memcpy(buf->string, step->payload, step->len);
+	memset(&buf->string[step->len], '\0', MAX_STR_SIZE - step->len);
+
+	buf->char_cnt = step->len;
+
+	return OK;
+}
+
+static ssize_t CallCommandAppend(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "Called APPEND command with subcommand %.*s.\n", (int)step->len, step->payload);
+
+	// String full
+	if ((buf->char_cnt + step->len) > (MAX_STR_SIZE - 1)) return BLOCKED;
+
+	memcpy(&buf->string[buf->char_cnt], step->payload, step->len);
+
+	buf->char_cnt += step->len;
+
+	printk(KERN_INFO "Character count is %zu.\n", buf->char_cnt);
+
+	return OK;
+}
+
+static ssize_t CallCommandTruncate(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "Called TRUNCATE command with subcommand %zu.\n", step->count);
+
+	// Too many characters to truncate
+	if (step->count > buf->char_cnt) return BLOCKED;
+
+	memset(&buf->string[buf->char_cnt - step->count], '\0', step->count);
+
+	buf->char_cnt -= step->count;
+
+	printk(KERN_INFO "Character count is %zu.\n", buf->char_cnt);
+
+	return OK;
+}
+
+static ssize_t CallCommandRemove(StredBuf_t *buf, const Step_t *step)
+{
+	size_t read_it;
+	size_t write_it = 0;
+
+	long   found;
+
+	printk(KERN_INFO "Called REMOVE command with subcommand %.*s.\n", (int)step->len, step->payload);
+
+	if (step->len == 0)
+	{
+		printk(KERN_WARNING "Nothing to remove.\n");
+		return (-EINVAL);
+	}
+
+	// Compact the string in place, moving whatever lies between two occurances in one go
+	read_it = 0;
+
+	while ((found = StredFind(buf->string, buf->char_cnt, step->payload, step->len, read_it)) != ERROR)
+	{
+		memmove(&buf->string[write_it], &buf->string[read_it], found - read_it);
+		write_it += found - read_it;
+		read_it   = found + step->len;
+	}
+
+	memmove(&buf->string[write_it], &buf->string[read_it], buf->char_cnt - read_it);
+	write_it += buf->char_cnt - read_it;
+
+	memset(&buf->string[write_it], '\0', buf->char_cnt - write_it);
+	buf->char_cnt = write_it;
+
+	printk(KERN_INFO "Character count is %zu.\n", buf->char_cnt);
+
+	return OK;
+}
+
+static ssize_t CallCommandInsert(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "Called INSERT command with subcommand %zu,%.*s.\n", step->count, (int)step->len, step->payload);
+
+	if (step->count > buf->char_cnt)
+	{
+		printk(KERN_WARNING "Offset %zu is past the end of the string.\n", step->count);
+		return (-EINVAL);
+	}
+
+	// String full
+	if ((buf->char_cnt + step->len) > (MAX_STR_SIZE - 1)) return BLOCKED;
+
+	memmove(&buf->string[step->count + step->len], &buf->string[step->count], buf->char_cnt - step->count);
+	memcpy(&buf->string[step->count], step->payload, step->len);
+
+	buf->char_cnt += step->len;
+
+	printk(KERN_INFO "Character count is %zu.\n", buf->char_cnt);
+
+	return OK;
+}
+
+// Commands which don't need a subcommand.
+static ssize_t CallCommandClear(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "Called CLEAR command.\n");
+
+	memset(buf->string, '\0', MAX_STR_SIZE);
+	buf->char_cnt = 0;
+
+	return OK;
+}
+
+static ssize_t CallCommandShrink(StredBuf_t *buf, const Step_t *step)
+{
+	size_t start = 0;
+	size_t end   = buf->char_cnt;
+
+	printk(KERN_INFO "Called SHRINK command.\n");
+
+	while ((start < end) && isspace((unsigned char)buf->string[start])) start++;
+	while ((end > start) && isspace((unsigned char)buf->string[end - 1])) end--;
+
+	memmove(buf->string, &buf->string[start], end - start);
+	memset(&buf->string[end - start], '\0', buf->char_cnt - (end - start));
+
+	buf->char_cnt = end - start;
+
+	printk(KERN_INFO "Character count is %zu.\n", buf->char_cnt);
+
+	return OK;
+}
+
+static ssize_t CallCommandFind(StredBuf_t *buf, const Step_t *step)
+{
+	size_t count = 0;
+	long   found;
+
+	if (step->len == 0)
+	{
+		printk(KERN_WARNING "Nothing to find.\n");
+		return (-EINVAL);
+	}
+
+	printk(KERN_INFO "Offsets of %.*s:", (int)step->len, step->payload);
+
+	found = StredFind(buf->string, buf->char_cnt, step->payload, step->len, 0);
+
+	while (found != ERROR)
+	{
+		printk(KERN_CONT " %ld", found);
+
+		count++;
+		found = StredFind(buf->string, buf->char_cnt, step->payload, step->len, found + step->len);
+	}
+
+	printk(KERN_CONT " (%zu in total).\n", count);
+
+	return OK;
+}
+
+static ssize_t CallCommandCount(StredBuf_t *buf, const Step_t *step)
+{
+	size_t count = 0;
+	long   found;
+
+	if (step->len == 0)
+	{
+		printk(KERN_WARNING "Nothing to count.\n");
+		return (-EINVAL);
+	}
+
+	found = StredFind(buf->string, buf->char_cnt, step->payload, step->len, 0);
+
+	while (found != ERROR)
+	{
+		count++;
+		found = StredFind(buf->string, buf->char_cnt, step->payload, step->len, found + step->len);
+	}
+
+	printk(KERN_INFO "%.*s occurs %zu time(s).\n", (int)step->len, step->payload, count);
+
+	return OK;
+}
+
+static ssize_t CallCommandHelp(StredBuf_t *buf, const Step_t *step)
+{
+	printk(KERN_INFO "%s", help_msg);
+	return OK;
+}
+
+static ssize_t ExecuteBatch(StredDev_t *dev, const Step_t steps[], int num_of_steps)
+{
+	StredBuf_t       *staged;
+	StredBuf_t       *live;
+	StredWaiter_t     waiter;
+	struct list_head *queue = NULL;		///< Waiter queue this batch is in, NULL while it isn't waiting.
+	struct list_head *target;
+
+	u64     locked_at;
+	u64     waited_at;
+	long    delta;
+	long    limit;
+	int     relative;
+	int     exact;
+	int     step_it;
+	ssize_t ret;
+
+	// Allocated outside the lock and reused if the batch has to wait and start over
+	staged = kmalloc(sizeof(*staged), GFP_KERNEL);
+
+	if (staged == NULL) return (-ENOMEM);
+
+	// Batches which only look at the string run on a snapshot, without taking sem or publishing a new version
+	for (step_it = 0; (step_it < num_of_steps) && commands[steps[step_it].command_id].read_only; step_it++);
+
+	if (step_it == num_of_steps)
+	{
+		rcu_read_lock();
+		memcpy(staged, rcu_dereference(dev->buf), sizeof(*staged));
+		rcu_read_unlock();
+
+		for (step_it = 0, ret = OK; (step_it < num_of_steps) && (ret == OK); step_it++)
+			ret = StredRunCommand(dev, staged, &steps[step_it]);
+
+		kfree(staged);
+		StredCount(dev, steps, num_of_steps, ret);
+
+		return ret;
+	}
+
+	init_waitqueue_head(&waiter.wait);
+	waiter.granted = b_FALSE;
+
+	for (;;)
+	{
+		waited_at = ktime_get_ns();
+
+		if(down_interruptible(&dev->sem))
+		{
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		locked_at = ktime_get_ns();
+		StredRecord(dev, steps, num_of_steps, LOCK_WAIT, waited_at);
+
+		if (queue == NULL)
+		{
+			// A new batch must not take the room or characters just granted to a waiter
+			if (StredMustYield(dev, steps, num_of_steps))
+			{
+				StredUnlock(dev, steps, num_of_steps, locked_at);
+
+				waited_at = ktime_get_ns();
+				ret       = wait_event_interruptible(dev->yield_queue, !StredMustYield(dev, steps, num_of_steps));
+				StredRecord(dev, steps, num_of_steps, QUEUE_WAIT, waited_at);
+
+				if (ret) break;
+
+				continue;
+			}
+
+			target = StredQueueBehind(dev, steps, num_of_steps, rcu_dereference_protected(dev->buf, b_TRUE)->char_cnt);
+
+			// Waiters of the same kind go first, this batch finds out what it needs once it is its turn
+			if (target != NULL)
+			{
+				list_add_tail(&waiter.node, target);
+				queue        = target;
+				waiter.limit = (target == &dev->append_waiters) ? LONG_MAX : LONG_MIN;
+
+				StredUnlock(dev, steps, num_of_steps, locked_at);
+
+				waited_at = ktime_get_ns();
+				ret       = wait_event_interruptible(waiter.wait, READ_ONCE(waiter.granted));
+				StredRecord(dev, steps, num_of_steps, QUEUE_WAIT, waited_at);
+
+				if (ret) break;
+
+				continue;
+			}
+		}
+		else if (waiter.granted)
+		{
+			// Granted waiter is running, whatever the outcome new batches held back by it may try again
+			if (queue == &dev->append_waiters)
+				dev->append_granted = b_FALSE;
+			else
+				dev->trunc_granted = b_FALSE;
+
+			waiter.granted = b_FALSE;
+			wake_up_interruptible(&dev->yield_queue);
+		}
+
+		// Writers are serialised by sem so the live version can't be replaced while it is being copied
+		live = rcu_dereference_protected(dev->buf, b_TRUE);
+		memcpy(staged, live, sizeof(*staged));
+
+		relative = b_TRUE;
+		exact    = b_TRUE;
+		ret      = OK;
+
+		for (step_it = 0; step_it < num_of_steps; step_it++)
+		{
+			ret = StredRunCommand(dev, staged, &steps[step_it]);
+
+			if (ret != OK) break;
+
+			// Appends, inserts and truncates change the length by an amount known in advance, removes and shrinks
+			// by one which depends on the contents, setting and clearing leave a length which doesn't depend on it
+			switch (steps[step_it].command_id)
+			{
+			case STRING:
+			case CLEAR:
+				relative = b_FALSE;
+				break ;
+			case REMOVE:
+			case SHRINK:
+				exact = b_FALSE;
+				break ;
+			default:
+				break ;
+			}
+		}
+
+		if (ret == OK)
+		{
+			staged->version = live->version + 1;
+			rcu_assign_pointer(dev->buf, staged);
+
+			printk(KERN_INFO "Successfully applied %d command(s), character count is %zu.\n", num_of_steps, staged->char_cnt);
+
+			if (queue != NULL)
+			{
+				list_del(&waiter.node);
+				queue = NULL;
+			}
+
+			// One wakeup for the whole batch, and only for a waiter whose request now fits
+			StredWakeHeads(dev, staged->char_cnt);
+
+			StredUnlock(dev, steps, num_of_steps, locked_at);
+
+			// Readers may still be copying the old version, it is freed after they are done
+			kfree_rcu(live, rcu);
+
+			StredCount(dev, steps, num_of_steps, OK);
+
+			return OK;
+		}
+
+		delta = (long)staged->char_cnt - (long)live->char_cnt;
+
+		if (ret != BLOCKED)
+		{
+			StredUnlock(dev, steps, num_of_steps, locked_at);
+			printk(KERN_WARNING "Command %d failed, none of the %d command(s) were applied.\n", step_it + 1, num_of_steps);
+			break;
+		}
+
+		// A preceding command set or cleared the string, no change made by others can make this batch fit
+		if (!relative)
+		{
+			StredUnlock(dev, steps, num_of_steps, locked_at);
+			printk(KERN_WARNING "Command %d can never be applied, none of the %d command(s) were applied.\n", step_it + 1, num_of_steps);
+			ret = (steps[step_it].command_id != TRUNCATE) ? (-EFBIG) : (-EINVAL);
+			break;
+		}
+
+		// Appends and inserts wait for room, truncates for characters
+		if (steps[step_it].command_id != TRUNCATE)
+		{
+			// Largest committed length at which the batch fits
+			limit  = (long)(MAX_STR_SIZE - 1) - (long)steps[step_it].len - delta;
+			target = &dev->append_waiters;
+
+			// After a remove or shrink a shorter string may lose fewer characters, try again whenever it shrinks.
+			// An empty string loses nothing, so then the batch never fits
+			if ((limit < 0) && !exact && (live->char_cnt != 0)) limit = (long)live->char_cnt - 1;
+
+			if (limit < 0)
+			{
+				StredUnlock(dev, steps, num_of_steps, locked_at);
+				printk(KERN_WARNING "String max size reached.\n");
+				ret = (-EFBIG);
+				break;
+			}
+		}
+		else
+		{
+			// Smallest committed length at which the batch fits
+			limit  = (long)steps[step_it].count - delta;
+			target = &dev->trunc_waiters;
+
+			// After a remove or shrink a longer string may keep more characters, try again whenever it grows
+			if ((limit > (long)(MAX_STR_SIZE - 1)) && !exact && (live->char_cnt < (MAX_STR_SIZE - 1)))
+				limit = (long)live->char_cnt + 1;
+
+			if (limit > (long)(MAX_STR_SIZE - 1))
+			{
+				StredUnlock(dev, steps, num_of_steps, locked_at);
+				printk(KERN_WARNING "String is too short to truncate.\n");
+				ret = (-EINVAL);
+				break;
+			}
+		}
+
+		// A retried batch keeps its place in line unless it now waits for something else
+		if (queue != target)
+		{
+			if (queue != NULL) list_del(&waiter.node);
+
+			list_add_tail(&waiter.node, target);
+			queue = target;
+		}
+
+		waiter.limit = limit;
+
+		// Moving between queues may have put someone else at the head of the old one
+		StredWakeHeads(dev, live->char_cnt);
+
+		StredUnlock(dev, steps, num_of_steps, locked_at);
+
+		// Put process in its queue until it is its turn and its request fits
+		waited_at = ktime_get_ns();
+		ret       = wait_event_interruptible(waiter.wait, READ_ONCE(waiter.granted));
+		StredRecord(dev, steps, num_of_steps, QUEUE_WAIT, waited_at);
+
+		if (ret) break;
+	}
+
+	// Leaving the line early, whatever was granted passes on to the next waiter
+	if (queue != NULL)
+	{
+		down(&dev->sem);
+		locked_at = ktime_get_ns();
+
+		if (waiter.granted)
+		{
+			if (queue == &dev->append_waiters)
+				dev->append_granted = b_FALSE;
+			else
+				dev->trunc_granted = b_FALSE;
+
+			wake_up_interruptible(&dev->yield_queue);
+		}
+
+		list_del(&waiter.node);
+		StredWakeHeads(dev, rcu_dereference_protected(dev->buf, b_TRUE)->char_cnt);
+
+		StredUnlock(dev, steps, num_of_steps, locked_at);
+	}
+
+	kfree(staged);
+	StredCount(dev, steps, num_of_steps, ret);
+
+	return ret;
+}
+
+static void StredWakeHeads(StredDev_t *dev, size_t char_cnt)
+{
+	struct list_head *queue;
+	StredWaiter_t    *waiter;
+	int              *granted;
+	int               in_order;
+
+	for (queue = &dev->append_waiters; queue != NULL; queue = (queue == &dev->append_waiters) ? &dev->trunc_waiters : NULL)
+	{
+		granted  = (queue == &dev->append_waiters) ? &dev->append_granted : &dev->trunc_granted;
+		in_order = StredInOrder(dev, queue, char_cnt);
+
+		if (*granted) continue;
+
+		list_for_each_entry(waiter, queue, node)
+		{
+			if (StredWaiterFits(dev, queue, waiter, char_cnt))
+			{
+				*granted = b_TRUE;
+				WRITE_ONCE(waiter->granted, b_TRUE);
+				wake_up_interruptible(&waiter->wait);
+				break;
+			}
+
+			if (in_order) break;
+		}
+	}
+}
+
+static int StredWaiterFits(StredDev_t *dev, const struct list_head *queue, const StredWaiter_t *waiter, size_t char_cnt)
+{
+	if (queue == &dev->append_waiters)
+		return ((long)char_cnt <= waiter->limit);
+	else
+		return ((long)char_cnt >= waiter->limit);
+}
+
+static int StredInOrder(StredDev_t *dev, const struct list_head *queue, size_t char_cnt)
+{
+	const struct list_head *other = (queue == &dev->append_waiters) ? &dev->trunc_waiters : &dev->append_waiters;
+	StredWaiter_t          *head  = list_first_entry_or_null(other, StredWaiter_t, node);
+
+	// Nothing the waiters of this queue need is stuck behind the other queue, whose head can run or is missing
+	return (head == NULL) || StredWaiterFits(dev, other, head, char_cnt);
+}
+
+static struct list_head *StredQueueBehind(StredDev_t *dev, const Step_t steps[], int num_of_steps, size_t char_cnt)
+{
+	int grows;
+	int shrinks;
+
+	StredDirection(steps, num_of_steps, &grows, &shrinks);
+
+	// Batches which move the length both ways may be what a head is waiting for, so they never line up
+	if (grows && !shrinks && !list_empty(&dev->append_waiters) && StredInOrder(dev, &dev->append_waiters, char_cnt))
+		return &dev->append_waiters;
+
+	if (shrinks && !grows && !list_empty(&dev->trunc_waiters) && StredInOrder(dev, &dev->trunc_waiters, char_cnt))
+		return &dev->trunc_waiters;
+
+	return NULL;
+}
+
+static int StredMustYield(StredDev_t *dev, const Step_t steps[], int num_of_steps)
+{
+	int grows;
+	int shrinks;
+
+	StredDirection(steps, num_of_steps, &grows, &shrinks);
+
+	return (grows && READ_ONCE(dev->append_granted)) || (shrinks && READ_ONCE(dev->trunc_granted));
+}
+
+static void StredDirection(const Step_t steps[], int num_of_steps, int *grows, int *shrinks)
+{
+	int step_it;
+
+	*grows   = b_FALSE;
+	*shrinks = b_FALSE;
+
+	for (step_it = 0; step_it < num_of_steps; step_it++)
+	{
+		if (commands[steps[step_it].command_id].read_only) continue;
+
+		switch (steps[step_it].command_id)
+		{
+		case APPEND:
+		case INSERT:
+			*grows = b_TRUE;
+			break ;
+		case TRUNCATE:
+		case REMOVE:
+		case CLEAR:
+		case SHRINK:
+			*shrinks = b_TRUE;
+			break ;
+		default:
+			// Only setting the string can move the length either way
+			*grows   = b_TRUE;
+			*shrinks = b_TRUE;
+			break ;
+		}
+	}
+}
+
+static long StredFind(const char string[], size_t len, const char pattern[], size_t pattern_len, size_t from)
+{
+	const char *pos;
+	const char *end;
+
+	if (pattern_len > len) return ERROR;
+
+	pos = string + from;
+	end = string + len - pattern_len + 1;	// One past the last offset an occurance can start at
+
+	while (pos < end)
+	{
+		pos = memchr(pos, pattern[0], end - pos);
+
+		if (pos == NULL) return ERROR;
+
+		if (!memcmp(pos + 1, pattern + 1, pattern_len - 1)) return (pos - string);
+
+		pos++;
+	}
+
+	return ERROR;
+}
+
+static ssize_t StredRunCommand(StredDev_t *dev, StredBuf_t *buf, const Step_t *step)
+{
+	u64     start;
+	ssize_t ret;
+
+	start = StredCommandStart(dev, step);
+	ret   = commands[step->command_id].handler(buf, step);
+
+	StredCommandDone(dev, step, ret, start);
+
+	return ret;
+}
+
+static u64 StredCommandStart(StredDev_t *dev, const Step_t *step)
+{
+	trace_stred_command_entry(dev->minor, step->command_id, step->len);
+
+	return ktime_get_ns();
+}
+
+static void StredCommandDone(StredDev_t *dev, const Step_t *step, ssize_t ret, u64 start)
+{
+	StredRecord(dev, step, 1, EXECUTION, start);
+	atomic64_inc(&dev->stats[step->command_id].attempts);
+	trace_stred_command_exit(dev->minor, step->command_id, ret, ktime_get_ns() - start);
+}
+
+static void StredRecord(StredDev_t *dev, const Step_t steps[], int num_of_steps, Hist_t hist, u64 start)
+{
+	int step_it;
+	int bucket = min_t(int, fls64(ktime_get_ns() - start), HIST_BUCKETS - 1);
+
+	// Every command of a batch is charged the time of the whole batch
+	for (step_it = 0; step_it < num_of_steps; step_it++)
+		atomic64_inc(&dev->stats[steps[step_it].command_id].hist[hist][bucket]);
+}
+
+static void StredUnlock(StredDev_t *dev, const Step_t steps[], int num_of_steps, u64 locked_at)
+{
+	up(&dev->sem);
+	StredRecord(dev, steps, num_of_steps, LOCK_HOLD, locked_at);
+}
+
+static void StredCount(StredDev_t *dev, const Step_t steps[], int num_of_steps, ssize_t ret)
+{
+	int step_it;
+
+	for (step_it = 0; step_it < num_of_steps; step_it++)
+	{
+		atomic64_inc(&dev->stats[steps[step_it].command_id].calls);
+
+		if (ret != OK) atomic64_inc(&dev->stats[steps[step_it].command_id].errors);
+	}
+}
+
+static size_t StredLength(StredDev_t *dev)
+{
+	size_t len;
+
+	rcu_read_lock();
+	len = rcu_dereference(dev->buf)->char_cnt;
+	rcu_read_unlock();
+
+	return len;
+}
+
+static const CommandDesc_t *FindCommand(const char name[], size_t name_len)
+{
+	Command_t command_id;
+
+	if (name_len == 0) return NULL;
+
+	// Command names are distinct in their first character except 'string'/'shrink' and 'clear'/'count'
+	switch (name[0])
+	{
+	case 's':
+		command_id = ((name_len > 1) && (name[1] == 'h')) ? SHRINK : STRING;
+		break ;
+	case 'f':
+		command_id = FIND;
+		break ;
+	case 'a':
+		command_id = APPEND;
+		break ;
+	case 't':
+		command_id = TRUNCATE;
+		break ;
+	case 'r':
+		command_id = REMOVE;
+		break ;
+	case 'c':
+		command_id = ((name_len > 1) && (name[1] == 'o')) ? COUNT : CLEAR;
+		break ;
+	case 'h':
+		command_id = HELP;
+		break ;
+	case 'i':
+		command_id = INSERT;
+		break ;
 	default:
+		return NULL;
+	}
+
+	if ((commands[command_id].name_len != name_len) || memcmp(commands[command_id].name, name, name_len))
+		return NULL;
+
+	return &commands[command_id];
+}
+
+static int ParseCount(const char payload[], size_t len, size_t *count)
+{
+	size_t it;
+	size_t value = 0;
+
+	if (len == 0) return ERROR;
+
+	for (it = 0; it < len; it++)
+	{
+		if ((payload[it] < '0') || (payload[it] > '9')) return ERROR;
+
+		// Nothing larger than the string itself can ever be truncated, so cap instead of overflowing
+		if (value < MAX_STR_SIZE)
+			value = (value * 10u) + (payload[it] - '0');
+	}
+
+	*count = value;
+
+	return OK;
+}
+
+static int ParseCommand(const char line[], size_t len, Step_t *step)
+{
+	const CommandDesc_t *command;
+	const char          *separator;
+
+	size_t name_len;
+
+	// Single pass: split on the first '=' and look the name up directly, the payload is everything after it
+	separator = memchr(line, '=', len);
+	name_len  = separator ? (size_t)(separator - line) : len;
+	command   = FindCommand(line, name_len);
+
+	if (!command || (command->has_payload != (separator != NULL)))
+	{
+		printk(KERN_WARNING "Command %.*s not recognized. Use echo \"help\" > stred_module to see the list of commands.\n", (int)len, line);
+		return ERROR;
+	}
+
+	step->command_id = (Command_t)(command - commands);
+	step->payload    = separator ? (separator + 1) : NULL;
+	step->len        = separator ? (len - name_len - 1) : 0;
+	step->count      = 0;
+
+	if ((step->command_id == TRUNCATE) && (ParseCount(step->payload, step->len, &step->count) != OK))
+	{
+		printk(KERN_WARNING "Format incorrect. Please use the following format: truncate=x where x is a positive integer value.\n");
+		return ERROR;
+	}
+
+	if (step->command_id == INSERT)
+	{
+		// insert=x,abc -> the offset ends at the first ',', the payload is everything after it
+		separator = memchr(step->payload, ',', step->len);
+
+		if ((separator == NULL) || (ParseCount(step->payload, separator - step->payload, &step->count) != OK))
+		{
+			printk(KERN_WARNING "Format incorrect. Please use the following format: insert=x,abc where x is a positive integer value.\n");
+			return ERROR;
+		}
+
+		step->len    -= (separator + 1) - step->payload;
+		step->payload = separator + 1;
+	}
+
+	return OK;
+}
+
+static int ParseBatch(const char input[], size_t len, Step_t steps[])
+{
+	const char *line = input;
+	const char *end  = input + len;
+	const char *newline;
+
+	int num_of_steps = 0;
+	int read_only    = 0;
+
+	while (line < end)
+	{
+		newline = memchr(line, '\n', end - line);
+
+		if (newline == NULL) newline = end;
+
+		// echo terminates the input with a newline, so empty lines are skipped rather than rejected
+		if (newline != line)
+		{
+			if (num_of_steps == MAX_BATCH_STEPS)
+			{
+				printk(KERN_WARNING "Too many commands, at most %u can be written at once.\n", MAX_BATCH_STEPS);
+				return (-E2BIG);
+			}
+
+			if (ParseCommand(line, newline - line, &steps[num_of_steps]) != OK) return (-EINVAL);
+
+			if (commands[steps[num_of_steps].command_id].read_only) read_only++;
+
+			num_of_steps++;
+		}
+
+		line = newline + 1;
+	}
+
+	if (num_of_steps == 0)
+	{
 		printk(KERN_WARNING "Command not recognized. Use echo \"help\" > stred_module to see the list of commands.\n");
-		return (-ERESTARTSYS);
-		break ;
+		return (-EINVAL);
 	}
 
-	return ret;
+	if ((read_only != 0) && (read_only != num_of_steps))
+	{
+		printk(KERN_WARNING "find, count and help can't be batched with commands which change the string.\n");
+		return (-EINVAL);
+	}
+
+	return num_of_steps;
 }
 
 module_init(StredInit);
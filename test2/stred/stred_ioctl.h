@@ -0,0 +1,57 @@
+#ifndef STRED_IOCTL_H
+#define STRED_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define STRED_IOC_MAGIC    ('S')
+
+/// Payload of the set, append, remove and insert ioctls. Payload may contain spaces and NUL characters.
+struct stred_ioc_data
+{
+	__u64 ptr;		///< User pointer to the payload.
+	__u64 len;		///< Payload length in bytes.
+	__u64 offset;	///< Position to insert at, ignored by every other ioctl.
+};
+
+/// Arguments and results of the find and count ioctls.
+struct stred_ioc_find
+{
+	__u64 ptr;			///< User pointer to the pattern.
+	__u64 len;			///< Pattern length in bytes.
+	__u64 from;			///< Offset to start searching at, lets a search continue where an earlier one stopped.
+	__u64 offsets;		///< User pointer to an array of __u32 filled with the offsets of occurances, ignored by count.
+	__u32 max_offsets;	///< Capacity of the offsets array.
+	__u32 count;		///< Returned total number of (non-overlapping) occurances, even if more than max_offsets.
+};
+
+/// Result of the version ioctl, both fields describe the same published version.
+struct stred_ioc_version
+{
+	__u64 version;		///< Incremented every time the string changes, so pollers can tell whether it did.
+	__u64 length;		///< Number of characters inside the string.
+};
+
+/*
+* Every ioctl returns 0 on success or a negative errno:
+*	-EINVAL      -> empty or too long remove, find or count pattern, insert offset past the end of the string,
+*					or a truncate by more characters than the string can ever hold.
+*	-EFBIG       -> set, append or insert payload which could never fit into the string.
+*	-EFAULT      -> invalid user pointer.
+*	-ENOMEM      -> out of memory.
+*	-EINTR       -> interrupted by a signal while waiting for the string to change.
+*	-ENOTTY      -> unknown ioctl.
+*/
+#define STRED_IOC_SET      _IOW(STRED_IOC_MAGIC, 1, struct stred_ioc_data)	///< Sets the string to the payload.
+#define STRED_IOC_APPEND   _IOW(STRED_IOC_MAGIC, 2, struct stred_ioc_data)	///< Appends the payload, waits while it doesn't fit.
+#define STRED_IOC_TRUNCATE _IOW(STRED_IOC_MAGIC, 3, __u64)					///< Truncates x characters, waits while the string is shorter.
+#define STRED_IOC_REMOVE   _IOW(STRED_IOC_MAGIC, 4, struct stred_ioc_data)	///< Removes all occurances of the payload.
+#define STRED_IOC_SHRINK   _IO(STRED_IOC_MAGIC, 5)							///< Removes whitespace at the start and end of the string.
+#define STRED_IOC_INSERT   _IOW(STRED_IOC_MAGIC, 6, struct stred_ioc_data)	///< Inserts the payload at offset, waits while it doesn't fit.
+#define STRED_IOC_LENGTH   _IOR(STRED_IOC_MAGIC, 7, __u64)					///< Returns the number of characters inside the string.
+#define STRED_IOC_CLEAR    _IO(STRED_IOC_MAGIC, 8)							///< Clears the string.
+#define STRED_IOC_FIND     _IOWR(STRED_IOC_MAGIC, 9, struct stred_ioc_find)	///< Lists the offsets of the pattern.
+#define STRED_IOC_COUNT    _IOWR(STRED_IOC_MAGIC, 10, struct stred_ioc_find)	///< Counts the occurances of the pattern.
+#define STRED_IOC_VERSION  _IOR(STRED_IOC_MAGIC, 11, struct stred_ioc_version)	///< Returns the version and length of the string.
+
+#endif // STRED_IOCTL_H
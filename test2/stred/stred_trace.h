@@ -0,0 +1,83 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stred
+
+#if !defined(STRED_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define STRED_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Command_t comes from stred.c, which defines it before including this header
+TRACE_DEFINE_ENUM(STRING);
+TRACE_DEFINE_ENUM(APPEND);
+TRACE_DEFINE_ENUM(TRUNCATE);
+TRACE_DEFINE_ENUM(REMOVE);
+TRACE_DEFINE_ENUM(CLEAR);
+TRACE_DEFINE_ENUM(SHRINK);
+TRACE_DEFINE_ENUM(HELP);
+TRACE_DEFINE_ENUM(INSERT);
+TRACE_DEFINE_ENUM(FIND);
+TRACE_DEFINE_ENUM(COUNT);
+
+/// Command names by Command_t value, keyed by the enum so the values can't drift from it.
+#define STRED_TRACE_COMMANDS												\
+	{ STRING, "string" }, { APPEND, "append" }, { TRUNCATE, "truncate" },	\
+	{ REMOVE, "remove" }, { CLEAR, "clear" },   { SHRINK, "shrink" },		\
+	{ HELP, "help" },     { INSERT, "insert" }, { FIND, "find" },			\
+	{ COUNT, "count" }
+
+/// Fired right before a command is applied to the string, again on every retry of a batch which had to wait.
+TRACE_EVENT(stred_command_entry,
+
+	TP_PROTO(unsigned int minor, int command_id, size_t len),
+
+	TP_ARGS(minor, command_id, len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int,          command_id)
+		__field(size_t,       len)
+	),
+
+	TP_fast_assign(
+		__entry->minor      = minor;
+		__entry->command_id = command_id;
+		__entry->len        = len;
+	),
+
+	TP_printk("minor=%u command=%s len=%zu",
+		__entry->minor, __print_symbolic(__entry->command_id, STRED_TRACE_COMMANDS), __entry->len)
+);
+
+/// Fired right after a command was applied to the string, ret is 0 (OK), 1 (BLOCKED) or a negative errno.
+TRACE_EVENT(stred_command_exit,
+
+	TP_PROTO(unsigned int minor, int command_id, long ret, u64 exec_ns),
+
+	TP_ARGS(minor, command_id, ret, exec_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int,          command_id)
+		__field(long,         ret)
+		__field(u64,          exec_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor      = minor;
+		__entry->command_id = command_id;
+		__entry->ret        = ret;
+		__entry->exec_ns    = exec_ns;
+	),
+
+	TP_printk("minor=%u command=%s ret=%ld exec_ns=%llu",
+		__entry->minor, __print_symbolic(__entry->command_id, STRED_TRACE_COMMANDS), __entry->ret, __entry->exec_ns)
+);
+
+#endif // STRED_TRACE_H
+
+// Must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE stred_trace
+#include <trace/define_trace.h>